@@ -6,12 +6,16 @@
 #include <strings.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
 #include <linux/ppdev.h>
+#include <linux/sockios.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 #define RINGER_RESET_TIME 15
@@ -25,6 +29,13 @@
 // Should end up being ~1K on most systems
 #define MAXIMUM_CLIENT_SUBSCRIPTIONS 64
 #define PARALLEL_PORT_DEVICE "/dev/parport0"
+// Local event stream. Consumers connect with SOCK_SEQPACKET and get one
+// struct gateman_event per packet.
+#define EVENT_SOCKET_PATH "/var/run/gateman/events.sock"
+// Must be a power of two. A consumer that falls this many events behind gets
+// disconnected.
+#define EVENT_RING_SIZE 256
+#define MAXIMUM_EVENT_CONSUMERS 16
 
 // Number of seconds to sleep in the main loop between iterations.
 #define MAIN_LOOP_SLEEP_TIME 100000
@@ -62,6 +73,27 @@ const char r_subscribe_success[] = "Ok, I'll keep you posted for up to MAXIMUM_S
 
 const char r_error[] = "Internal error.\n";
 
+// Events published on EVENT_SOCKET_PATH. Each packet is a single
+// struct gateman_event in host byte order. Sequence numbers increase by one
+// per event, so a consumer can notice a gap after reconnecting.
+enum gateman_event_type {
+  EVENT_RING_START = 1,
+  // Fires when the latched ringer state clears, RINGER_RESET_TIME seconds
+  // after the ring started, not when the button is released.
+  EVENT_RING_STOP = 2,
+  EVENT_GATE_OPENED = 3,
+  // Fires when an OPEN! request is refused because the gate was buzzed open
+  // less than BUZZER_SOLENOID_REST_TIME seconds ago. There's no
+  // authorization, so this is the only kind of denial.
+  EVENT_GATE_DENIED = 4
+};
+struct gateman_event {
+  uint32_t sequence;
+  uint32_t type;
+  uint32_t time_sec;
+  uint32_t time_usec;
+};
+
 // Represents if the ringer (call to get in) is ringing or has been recently rung.
 unsigned short ringer_state = 0;
 // Represents if the buzzer is ringing or has been recently buzzed.
@@ -76,6 +108,7 @@ struct timeval last_buzzer_firing, last_buzzer_request;
 int parport_file_descriptor;
 // Defined in the global scope, as other functions will need this.
 int listen_file_descriptor;
+int event_listen_file_descriptor = -1;
 
 // Some structure to keep track of interested receivers.
 // A "subscription" describes the time last described, and a sockaddr for the interested client.
@@ -213,6 +246,168 @@ void update_ringer_subscriptions() {
   }
 }
 
+// The event stream. Published events go into a fixed ring, and every
+// connected consumer keeps its own cursor (the sequence number of the next
+// event it should be sent). Writes to consumers never block: anything the
+// socket won't take right now stays in the ring and is retried from the main
+// loop. A consumer that gets lapped by the ring is disconnected rather than
+// silently skipped, so delivery to a connected consumer is lossless.
+struct event_consumer {
+  int fd; // -1 when the slot is free.
+  uint32_t cursor;
+};
+
+struct gateman_event event_ring[EVENT_RING_SIZE];
+uint32_t next_event_sequence = 0;
+struct event_consumer event_consumers[MAXIMUM_EVENT_CONSUMERS];
+
+void init_event_consumers() {
+  int i;
+  for (i = 0; i < MAXIMUM_EVENT_CONSUMERS; i++) {
+    event_consumers[i].fd = -1;
+  }
+}
+
+void drop_event_consumer(struct event_consumer* consumer) {
+#ifdef DEBUG
+  fprintf(stderr, "Dropping event consumer on fd %d\n", consumer->fd);
+#endif
+  close(consumer->fd);
+  consumer->fd = -1;
+}
+
+// How far behind a consumer is: events still waiting in the ring, plus bytes
+// already sent but not yet read out of the kernel queue. Only meaningful for
+// comparing consumers against each other.
+unsigned long event_consumer_lag(struct event_consumer* consumer) {
+  int queued = 0;
+  ioctl(consumer->fd, SIOCOUTQ, &queued);
+  return((unsigned long)(uint32_t)(next_event_sequence - consumer->cursor) * sizeof(struct gateman_event) + (unsigned long)queued);
+}
+
+// Take one connection off the event socket and start it at the current end
+// of the ring. If every slot is taken, evict the consumer that is furthest
+// behind to make room. Returns -1 once the backlog is empty.
+int accept_event_consumer() {
+  int fd, i;
+  struct event_consumer* slot = NULL;
+  fd = accept(event_listen_file_descriptor, NULL, NULL);
+  if (fd < 0) {
+    return(-1);
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  for (i = 0; i < MAXIMUM_EVENT_CONSUMERS; i++) {
+    if (event_consumers[i].fd < 0) {
+      slot = &event_consumers[i];
+      break;
+    }
+    if (slot == NULL || event_consumer_lag(&event_consumers[i]) > event_consumer_lag(slot)) {
+      slot = &event_consumers[i];
+    }
+  }
+  if (slot->fd >= 0) {
+    fprintf(stderr, "Event consumers full, evicting the one on fd %d.\n", slot->fd);
+    drop_event_consumer(slot);
+  }
+  slot->fd = fd;
+  slot->cursor = next_event_sequence;
+  return(0);
+}
+
+// Accept everything queued on the event socket. This has to run before any
+// event is published, or a consumer whose connect() already returned would
+// start after that event and never see it.
+void accept_event_consumers() {
+  if (event_listen_file_descriptor < 0) {
+    return;
+  }
+  while (accept_event_consumer() == 0) {
+  }
+}
+
+// Send a consumer everything it hasn't seen yet, until the socket is full.
+void flush_event_consumer(struct event_consumer* consumer) {
+  ssize_t bytes_sent;
+  while (consumer->cursor != next_event_sequence) {
+    if ((uint32_t)(next_event_sequence - consumer->cursor) > EVENT_RING_SIZE) {
+      // Lapped; the events it needed have been overwritten.
+      drop_event_consumer(consumer);
+      return;
+    }
+    bytes_sent = send(consumer->fd, &event_ring[consumer->cursor & (EVENT_RING_SIZE-1)], sizeof(struct gateman_event), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        drop_event_consumer(consumer);
+      }
+      return;
+    }
+    consumer->cursor++;
+  }
+}
+
+void flush_event_consumers() {
+  int i;
+  for (i = 0; i < MAXIMUM_EVENT_CONSUMERS; i++) {
+    if (event_consumers[i].fd >= 0) {
+      flush_event_consumer(&event_consumers[i]);
+    }
+  }
+}
+
+void publish_event(enum gateman_event_type type) {
+  struct timeval now;
+  struct gateman_event* event = &event_ring[next_event_sequence & (EVENT_RING_SIZE-1)];
+  gettimeofday(&now, NULL);
+  event->sequence = next_event_sequence;
+  event->type = type;
+  event->time_sec = (uint32_t)now.tv_sec;
+  event->time_usec = (uint32_t)now.tv_usec;
+  next_event_sequence++;
+  flush_event_consumers();
+}
+
+// Open up the event socket. Failure here isn't fatal; the UDP interface keeps
+// working without it.
+int open_event_socket() {
+  int fd, result;
+  struct sockaddr_un event_address;
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0) {
+    perror("Error in opening event socket: ");
+    return(-1);
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  bzero(&event_address, sizeof(event_address));
+  event_address.sun_family = AF_UNIX;
+  strncpy(event_address.sun_path, EVENT_SOCKET_PATH, sizeof(event_address.sun_path)-1);
+  // Clear out a socket left over from a previous run.
+  unlink(EVENT_SOCKET_PATH);
+  result = bind(fd, (struct sockaddr *)&event_address, sizeof(event_address));
+  if (result < 0) {
+    perror("Error in binding the event socket: ");
+    close(fd);
+    return(-1);
+  }
+  // connect() needs write permission on the socket file. Let any local user
+  // in, same as the loopback UDP interface.
+  result = chmod(EVENT_SOCKET_PATH, 0666);
+  if (result < 0) {
+    perror("Error in setting the event socket's mode: ");
+    close(fd);
+    return(-1);
+  }
+  result = listen(fd, MAXIMUM_EVENT_CONSUMERS);
+  if (result < 0) {
+    perror("Error in listening on the event socket: ");
+    close(fd);
+    return(-1);
+  }
+  return(fd);
+}
+
 // Check to see if the ringer call button is currently depressed.
 int is_buzzer_ringing(void) {
   int result;
@@ -249,6 +444,7 @@ void update_ringer_state(void) {
 #ifdef DEBUG
     fprintf(stderr, "ringer_state clearing...\n");
 #endif
+    publish_event(EVENT_RING_STOP);
   } else if ( ringer_state == 0 && result == 1 ) {
 #ifdef DEBUG
     fprintf(stderr, "ringer_state is getting set. We're ringing.\n");
@@ -256,6 +452,7 @@ void update_ringer_state(void) {
     ringer_state = 1;
     last_ring_detected = now;
     update_ringer_subscriptions();
+    publish_event(EVENT_RING_START);
   }
 }
 
@@ -359,7 +556,7 @@ int main() {
   useconds_t sleeptime = MAIN_LOOP_SLEEP_TIME;
   ssize_t bytes_received;
   socklen_t client_struct_length = sizeof(client_address);
-  fd_set read_file_descriptors;
+  fd_set read_file_descriptors, write_file_descriptors;
   struct timeval select_timeout = {
     .tv_sec = 0,
     .tv_usec = SELECT_TIMEOUT
@@ -420,8 +617,12 @@ int main() {
     exit(1);
   }
 
+  init_event_consumers();
+  event_listen_file_descriptor = open_event_socket();
+
   for(;;) {
     // Update ringer state
+    accept_event_consumers();
     update_ringer_state();
     update_buzzer_state();
     purge_expired_subscriptions();
@@ -434,10 +635,48 @@ int main() {
     select_timeout.tv_sec = 0;
     select_timeout.tv_usec = SELECT_TIMEOUT;
     FD_ZERO(&read_file_descriptors);
+    FD_ZERO(&write_file_descriptors);
     FD_SET(listen_file_descriptor, &read_file_descriptors);
-    result = select(FD_SETSIZE, &read_file_descriptors, NULL, NULL, &select_timeout);
+    if (event_listen_file_descriptor >= 0) {
+      FD_SET(event_listen_file_descriptor, &read_file_descriptors);
+    }
+    // Watch consumers for hangups, and for room to send if they're behind.
+    int c;
+    for (c = 0; c < MAXIMUM_EVENT_CONSUMERS; c++) {
+      if (event_consumers[c].fd >= 0) {
+        FD_SET(event_consumers[c].fd, &read_file_descriptors);
+        if (event_consumers[c].cursor != next_event_sequence) {
+          FD_SET(event_consumers[c].fd, &write_file_descriptors);
+        }
+      }
+    }
+    result = select(FD_SETSIZE, &read_file_descriptors, &write_file_descriptors, NULL, &select_timeout);
 
+    if (result > 0 && event_listen_file_descriptor >= 0 && FD_ISSET(event_listen_file_descriptor, &read_file_descriptors)) {
+      accept_event_consumers();
+    }
     if (result > 0) {
+      for (c = 0; c < MAXIMUM_EVENT_CONSUMERS; c++) {
+        if (event_consumers[c].fd < 0) {
+          continue;
+        }
+        if (FD_ISSET(event_consumers[c].fd, &read_file_descriptors)) {
+          // Consumers don't send anything; readable means they've gone away.
+          char discard[16];
+          ssize_t bytes_read = recv(event_consumers[c].fd, discard, sizeof(discard), MSG_DONTWAIT);
+          if (bytes_read == 0 ||
+              (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            drop_event_consumer(&event_consumers[c]);
+            continue;
+          }
+        }
+        if (FD_ISSET(event_consumers[c].fd, &write_file_descriptors)) {
+          flush_event_consumer(&event_consumers[c]);
+        }
+      }
+    }
+
+    if (result > 0 && FD_ISSET(listen_file_descriptor, &read_file_descriptors)) {
       bytes_received = recvfrom(listen_file_descriptor, &command_buffer, sizeof(command_buffer), MSG_DONTWAIT, (struct sockaddr *)&client_address, &client_struct_length);
 
       if (bytes_received > 0) { // we got something, handle it
@@ -456,8 +695,10 @@ int main() {
 #endif
           result = buzz_open_gate();
           if (result == 0) {
+            publish_event(EVENT_GATE_OPENED);
             send_response(listen_file_descriptor, (struct sockaddr *)&client_address, client_struct_length, r_acknowledged, sizeof(r_acknowledged));
           } else if (result == 1) {
+            publish_event(EVENT_GATE_DENIED);
             send_response(listen_file_descriptor, (struct sockaddr *)&client_address, client_struct_length, r_already_opened, sizeof(r_already_opened));
           } else {
             send_response(listen_file_descriptor, (struct sockaddr *)&client_address, client_struct_length, r_error, sizeof(r_error));
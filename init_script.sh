@@ -45,6 +45,8 @@ do_start()
 	#   0 if daemon has been started
 	#   1 if daemon was already running
 	#   2 if daemon could not be started
+	# Somewhere for the event socket that the daemon user can write to.
+	install -d -o gateman -g lp -m 0755 /var/run/$NAME
 	start-stop-daemon --start --quiet --make-pidfile --pidfile $PIDFILE --chuid gateman:lp --exec $DAEMON --test > /dev/null \
 		|| return 1
 	start-stop-daemon --start --quiet --make-pidfile --pidfile $PIDFILE --chuid gateman:lp --exec $DAEMON -- \